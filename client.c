@@ -67,8 +67,16 @@ void *receive_messages(void *arg) {
         }
         buffer[bytes_received] = '\0';
         
-        // Handle server exit acknowledgment
-        if (strcmp(buffer, "SERVER_EXIT_ACK\n") == 0) {
+        // Handle server exit acknowledgment; it may arrive after queued messages
+        char *exit_ack = strstr(buffer, "SERVER_EXIT_ACK\n");
+        if (exit_ack != NULL) {
+            *exit_ack = '\0';
+            if (exit_ack != buffer) {
+                pthread_mutex_lock(&mutex);
+                clear_line();
+                printf("%s", buffer);
+                pthread_mutex_unlock(&mutex);
+            }
             printf("\nExiting chat... Press enter to exit\n");
             client_running = false;
             // Force main thread to exit by closing the socket
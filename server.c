@@ -14,15 +14,35 @@
 #include <fcntl.h>
 #include <semaphore.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #define PORT 8888
+#ifndef MAX_CLIENTS
 #define MAX_CLIENTS 50
+#endif
 #define BUFFER_SIZE 1024
 #define USERNAME_SIZE 32
 #define ROOM_NAME_SIZE 32
+#ifdef CHAT_SIM
+#define SEM_NAME "/chat_sem_sim"
+#define FLUSH_SEM_NAME "/chat_flush_sem_sim"
+#else
 #define SEM_NAME "/chat_sem"
+#define FLUSH_SEM_NAME "/chat_flush_sem"
+#endif
+
+// Large-room mode: messages posted to an opted-in room are coalesced into
+// one batch per tick and that single buffer is sent to every member. A batch
+// that fills up before the tick is flushed early.
+#define MAX_LARGE_ROOMS 8
+#define ROOM_TICK_MS 50
+#define ROOM_BATCH_SIZE 16384
+#define ROOM_MAX_EXCLUDES 64
 
 typedef struct {
+    int target_index;
     int target_socket;
     char message[BUFFER_SIZE];
 } MessageData;
@@ -32,18 +52,55 @@ typedef struct {
     char username[USERNAME_SIZE];
     char current_room[ROOM_NAME_SIZE];
     bool is_active;
+    bool in_large_room;
     pid_t handler_pid;
 } Client;
 
+// A batched line that one member must not receive (their own join/leave notice)
+typedef struct {
+    int client_index;
+    size_t offset;
+    size_t len;
+} BatchExclude;
+
+typedef struct {
+    char name[ROOM_NAME_SIZE];
+    char batch[ROOM_BATCH_SIZE];
+    size_t batch_len;
+    int batch_count;  // Messages held in batch
+    BatchExclude excludes[ROOM_MAX_EXCLUDES];
+    int exclude_count;
+} LargeRoom;
+
 typedef struct {
     Client clients[MAX_CLIENTS];
     int message_pipe[2];  
+    LargeRoom large_rooms[MAX_LARGE_ROOMS];
+    int large_room_count;
 } SharedData;
 
+// Per-subscriber delivery state for large rooms, owned by the main process.
+// Room traffic that can't go out behind an unsent tail is counted and later
+// reported as a digest line. Direct messages (PMs, replies, the exit ack)
+// are never skipped; they queue behind the tail instead. The tail buffer is
+// only allocated once a send to that slot comes up short.
+typedef struct {
+    int socket;
+    int skipped;
+    size_t tail_len;
+    size_t tail_cap;
+    char *tail;
+} SubscriberLag;
+
 SharedData *shared_data;
 sem_t *mutex_sem;
+sem_t *flush_sem;  // Posted to flush large-room batches before the next tick
 volatile bool server_running = true;
 pthread_t msg_thread;
+pthread_t room_thread;
+bool room_thread_started = false;
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+static SubscriberLag lag_state[MAX_CLIENTS];
 pid_t main_pid;
 int server_socket;
 static volatile sig_atomic_t cleanup_in_progress = 0;
@@ -76,6 +133,10 @@ void cleanup() {
     // Cancel and wait for message thread
     pthread_cancel(msg_thread);
     pthread_join(msg_thread, NULL);
+    if (room_thread_started) {
+        pthread_cancel(room_thread);
+        pthread_join(room_thread, NULL);
+    }
     
     sem_wait(mutex_sem);
     // Close all client sockets
@@ -95,6 +156,8 @@ void cleanup() {
     // Cleanup IPC resources
     sem_close(mutex_sem);
     sem_unlink(SEM_NAME);
+    sem_close(flush_sem);
+    sem_unlink(FLUSH_SEM_NAME);
     close(shared_data->message_pipe[0]);
     close(shared_data->message_pipe[1]);
     munmap(shared_data, sizeof(SharedData));
@@ -145,34 +208,327 @@ void init_shared_memory() {
         exit(EXIT_FAILURE);
     }
 
+    sem_unlink(FLUSH_SEM_NAME);
+    flush_sem = sem_open(FLUSH_SEM_NAME, O_CREAT | O_EXCL, 0644, 0);
+    if (flush_sem == SEM_FAILED) {
+        perror("sem_open failed");
+        exit(EXIT_FAILURE);
+    }
+
     // Initialize clients
     for (int i = 0; i < MAX_CLIENTS; i++) {
         shared_data->clients[i].is_active = false;
+        shared_data->clients[i].in_large_room = false;
         shared_data->clients[i].socket = -1;
         shared_data->clients[i].handler_pid = 0;
+        lag_state[i].socket = -1;
+    }
+    shared_data->large_room_count = 0;
+}
+
+int add_large_room(const char *room) {
+    if (shared_data->large_room_count >= MAX_LARGE_ROOMS) {
+        return -1;
+    }
+    LargeRoom *large = &shared_data->large_rooms[shared_data->large_room_count++];
+    strncpy(large->name, room, ROOM_NAME_SIZE - 1);
+    large->name[ROOM_NAME_SIZE - 1] = '\0';
+    large->batch_len = 0;
+    large->batch_count = 0;
+    large->exclude_count = 0;
+    return 0;
+}
+
+// Caller must hold mutex_sem
+LargeRoom *find_large_room(const char *room) {
+    for (int i = 0; i < shared_data->large_room_count; i++) {
+        if (strcmp(shared_data->large_rooms[i].name, room) == 0) {
+            return &shared_data->large_rooms[i];
+        }
     }
+    return NULL;
+}
+
+int format_skip_digest(char *buffer, size_t size, int skipped) {
+    if (skipped == 1) {
+        return snprintf(buffer, size, "* 1 message skipped\n");
+    }
+    return snprintf(buffer, size, "* %d messages skipped\n", skipped);
 }
 
-void send_message_to_socket(int socket, const char *message) {
+#ifdef CHAT_SIM
+static bool sim_outbound_pending(int client_index);
+static void sim_send_blocking(int client_index, int socket, const char *data, size_t len);
+static void sim_pipe_push(const MessageData *msg_data);
+#endif
+
+// Returns how many bytes the kernel took without blocking
+size_t send_nonblocking(SubscriberLag *lag, const char *data, size_t len) {
+#ifdef CHAT_SIM
+    // Bytes the simulated handler is still blocked on go out first
+    if (sim_outbound_pending(lag - lag_state)) {
+        return 0;
+    }
+#endif
+    ssize_t n = send(lag->socket, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return n > 0 ? (size_t)n : 0;
+}
+
+bool append_tail(SubscriberLag *lag, const char *data, size_t len) {
+    if (lag->tail_len + len > lag->tail_cap) {
+        size_t cap = lag->tail_cap ? lag->tail_cap : ROOM_BATCH_SIZE;
+        while (cap < lag->tail_len + len) {
+            cap *= 2;
+        }
+        char *tail = realloc(lag->tail, cap);
+        if (tail == NULL) {
+            return false;
+        }
+        lag->tail = tail;
+        lag->tail_cap = cap;
+    }
+    memcpy(lag->tail + lag->tail_len, data, len);
+    lag->tail_len += len;
+    return true;
+}
+
+// Caller must hold send_lock
+SubscriberLag *get_lag_state(int client_index, int socket) {
+    SubscriberLag *lag = &lag_state[client_index];
+    if (lag->socket != socket) {
+        // Slot was reused by a new connection
+        lag->socket = socket;
+        lag->skipped = 0;
+        lag->tail_len = 0;
+    }
+    return lag;
+}
+
+// Returns true once nothing is left over from earlier partial sends
+bool flush_tail(SubscriberLag *lag) {
+    if (lag->tail_len == 0) {
+        return true;
+    }
+    size_t n = send_nonblocking(lag, lag->tail, lag->tail_len);
+    lag->tail_len -= n;
+    memmove(lag->tail, lag->tail + n, lag->tail_len);
+    return lag->tail_len == 0;
+}
+
+// Sends the digest for skipped room traffic, if any is owed. Returns true
+// once it is fully out; a partially sent digest finishes from the tail.
+bool flush_digest(SubscriberLag *lag) {
+    if (lag->skipped == 0) {
+        return true;
+    }
+    char digest[64];
+    size_t digest_len = format_skip_digest(digest, sizeof(digest), lag->skipped);
+    size_t n = send_nonblocking(lag, digest, digest_len);
+    if (n == 0) {
+        return false;
+    }
+    lag->skipped = 0;
+    if (n < digest_len) {
+        append_tail(lag, digest + n, digest_len - n);
+        return false;
+    }
+    return true;
+}
+
+// Caller must hold send_lock. count is how many messages data carries; if it
+// can't go out now they are added to the client's skipped total.
+void deliver_room_batch(int client_index, int socket, const char *data, size_t len, int count) {
+    SubscriberLag *lag = get_lag_state(client_index, socket);
+    if (!flush_tail(lag) || !flush_digest(lag)) {
+        lag->skipped += count;
+        return;
+    }
+    size_t n = send_nonblocking(lag, data, len);
+    if (n == 0) {
+        lag->skipped += count;
+    } else if (n < len) {
+        append_tail(lag, data + n, len - n);
+    }
+}
+
+// Caller must hold send_lock. Whatever doesn't go out now waits in the tail.
+void deliver_direct(int client_index, int socket, const char *data, size_t len) {
+    SubscriberLag *lag = get_lag_state(client_index, socket);
+    size_t n = 0;
+    if (flush_tail(lag) && flush_digest(lag)) {
+        n = send_nonblocking(lag, data, len);
+    }
+    if (n < len) {
+        append_tail(lag, data + n, len - n);
+    }
+}
+
+// Retries pending tails and digests so lagging members catch up even when
+// their room is quiet
+void retry_lagging_clients() {
+    pthread_mutex_lock(&send_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        SubscriberLag *lag = &lag_state[i];
+        if (lag->tail_len == 0 && lag->skipped == 0) {
+            continue;
+        }
+        if (!shared_data->clients[i].is_active || shared_data->clients[i].socket != lag->socket) {
+            continue;
+        }
+        if (flush_tail(lag)) {
+            flush_digest(lag);
+        }
+    }
+    pthread_mutex_unlock(&send_lock);
+}
+
+void deliver_message(const MessageData *msg_data) {
+    int client_index = msg_data->target_index;
+    size_t len = strlen(msg_data->message);
+
+    pthread_mutex_lock(&send_lock);
+    SubscriberLag *lag = &lag_state[client_index];
+    bool lagging = lag->socket == msg_data->target_socket &&
+                   (lag->tail_len > 0 || lag->skipped > 0);
+    if (shared_data->clients[client_index].in_large_room || lagging) {
+        // Never block while holding send_lock, the room flush needs it
+        deliver_direct(client_index, msg_data->target_socket, msg_data->message, len);
+        pthread_mutex_unlock(&send_lock);
+        return;
+    }
+    pthread_mutex_unlock(&send_lock);
+
+#ifdef CHAT_SIM
+    // Sockets are non-blocking here; queue whatever the real server would block on
+    sim_send_blocking(client_index, msg_data->target_socket, msg_data->message, len);
+#else
+    send(msg_data->target_socket, msg_data->message, len, MSG_NOSIGNAL);
+#endif
+}
+
+void send_message_to_client(int client_index, const char *message) {
     MessageData msg_data;
-    msg_data.target_socket = socket;
+    msg_data.target_index = client_index;
+    msg_data.target_socket = shared_data->clients[client_index].socket;
     strncpy(msg_data.message, message, BUFFER_SIZE - 1);
     msg_data.message[BUFFER_SIZE - 1] = '\0';
     
+#ifdef CHAT_SIM
+    // Drained by the simulated message handler
+    sim_pipe_push(&msg_data);
+#else
     write(shared_data->message_pipe[1], &msg_data, sizeof(MessageData));
+#endif
 }
 
 void *message_handler(void *arg) {
+    (void)arg;
     MessageData msg_data;
     while (server_running) {
         ssize_t n = read(shared_data->message_pipe[0], &msg_data, sizeof(MessageData));
         if (n > 0 && server_running) {
-            send(msg_data.target_socket, msg_data.message, strlen(msg_data.message), MSG_NOSIGNAL);
+            deliver_message(&msg_data);
         }
     }
     return NULL;
 }
 
+// Copies encoded into out without the lines excluded for client_index.
+// Returns how many lines were left out.
+int strip_excluded_lines(const char *encoded, size_t encoded_len,
+                         const BatchExclude *excludes, int exclude_count, int client_index,
+                         char *out, size_t *out_len) {
+    size_t pos = 0;
+    int removed = 0;
+    *out_len = 0;
+    for (int i = 0; i < exclude_count; i++) {
+        if (excludes[i].client_index != client_index) {
+            continue;
+        }
+        size_t start = excludes[i].offset;
+        memcpy(out + *out_len, encoded + pos, start - pos);
+        *out_len += start - pos;
+        pos = start + excludes[i].len;
+        removed++;
+    }
+    memcpy(out + *out_len, encoded + pos, encoded_len - pos);
+    *out_len += encoded_len - pos;
+    return removed;
+}
+
+void flush_large_room(int room_index) {
+    char encoded[ROOM_BATCH_SIZE];
+    char member_encoded[ROOM_BATCH_SIZE];
+    BatchExclude excludes[ROOM_MAX_EXCLUDES];
+    int members[MAX_CLIENTS];
+    int member_sockets[MAX_CLIENTS];
+    int member_count = 0;
+
+    sem_wait(mutex_sem);
+    LargeRoom *large = &shared_data->large_rooms[room_index];
+    if (large->batch_len == 0) {
+        sem_post(mutex_sem);
+        return;
+    }
+
+    int count = large->batch_count;
+    size_t encoded_len = large->batch_len;
+    memcpy(encoded, large->batch, encoded_len);
+    int exclude_count = large->exclude_count;
+    memcpy(excludes, large->excludes, exclude_count * sizeof(BatchExclude));
+    large->batch_len = 0;
+    large->batch_count = 0;
+    large->exclude_count = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (shared_data->clients[i].is_active &&
+            strcmp(shared_data->clients[i].current_room, large->name) == 0) {
+            members[member_count] = i;
+            member_sockets[member_count] = shared_data->clients[i].socket;
+            member_count++;
+        }
+    }
+    sem_post(mutex_sem);
+
+    pthread_mutex_lock(&send_lock);
+    for (int i = 0; i < member_count; i++) {
+        if (exclude_count > 0) {
+            size_t member_len;
+            int removed = strip_excluded_lines(encoded, encoded_len, excludes,
+                                               exclude_count, members[i], member_encoded, &member_len);
+            if (removed > 0) {
+                if (member_len > 0) {
+                    deliver_room_batch(members[i], member_sockets[i], member_encoded, member_len,
+                                       count - removed);
+                }
+                continue;
+            }
+        }
+        deliver_room_batch(members[i], member_sockets[i], encoded, encoded_len, count);
+    }
+    pthread_mutex_unlock(&send_lock);
+}
+
+void *room_flush_handler(void *arg) {
+    (void)arg;
+    while (server_running) {
+        // Sleep for a tick unless a sender asks for an early flush
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ROOM_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(flush_sem, &deadline);
+        for (int i = 0; i < shared_data->large_room_count && server_running; i++) {
+            flush_large_room(i);
+        }
+        retry_lagging_clients();
+    }
+    return NULL;
+}
+
 int find_free_slot() {
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (!shared_data->clients[i].is_active) {
@@ -192,17 +548,65 @@ int find_client_by_username(const char *username) {
     return -1;
 }
 
-void broadcast_to_room(const char *message, const char *room, int exclude_socket) {
+// Caller must hold mutex_sem. Hands the lock over until the room's batch has
+// been taken, so a full batch delays the sender instead of losing messages.
+void wait_for_room_flush(int room_index) {
+    sem_post(mutex_sem);
+#ifdef CHAT_SIM
+    flush_large_room(room_index);
+#else
+    (void)room_index;  // The flush thread takes every room
+    sem_post(flush_sem);
+    usleep(1000);
+#endif
     sem_wait(mutex_sem);
-    printf("Broadcasting to room %s: %s", room, message);
-    
+}
+
+bool batch_has_space(const LargeRoom *large, size_t len, int exclude_index) {
+    return large->batch_len + len <= ROOM_BATCH_SIZE &&
+           (exclude_index == -1 || large->exclude_count < ROOM_MAX_EXCLUDES);
+}
+
+// Caller must hold mutex_sem. In a large room an excluded member's line is
+// recorded and cut from their copy at flush.
+void broadcast_to_room_locked(const char *message, const char *room, int exclude_index) {
+    LargeRoom *large = find_large_room(room);
+    if (large != NULL) {
+        size_t len = strlen(message);
+        while (!batch_has_space(large, len, exclude_index)) {
+            wait_for_room_flush(large - shared_data->large_rooms);
+        }
+        if (exclude_index != -1) {
+            BatchExclude *exclude = &large->excludes[large->exclude_count++];
+            exclude->client_index = exclude_index;
+            exclude->offset = large->batch_len;
+            exclude->len = len;
+        }
+        memcpy(large->batch + large->batch_len, message, len);
+        large->batch_len += len;
+        large->batch_count++;
+#ifndef CHAT_SIM
+        // Wake the flush thread early once the batch is half full
+        if (large->batch_len > ROOM_BATCH_SIZE / 2 && large->batch_len - len <= ROOM_BATCH_SIZE / 2) {
+            sem_post(flush_sem);
+        }
+#endif
+        return;
+    }
+
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (shared_data->clients[i].is_active && 
             strcmp(shared_data->clients[i].current_room, room) == 0 &&
-            shared_data->clients[i].socket != exclude_socket) {
-            send_message_to_socket(shared_data->clients[i].socket, message);
+            i != exclude_index) {
+            send_message_to_client(i, message);
         }
     }
+}
+
+void broadcast_to_room(const char *message, const char *room, int exclude_index) {
+    sem_wait(mutex_sem);
+    printf("Broadcasting to room %s: %s", room, message);
+    broadcast_to_room_locked(message, room, exclude_index);
     sem_post(mutex_sem);
 }
 
@@ -214,7 +618,7 @@ void send_private_message(const char *from_username, const char *to_username, co
         if (from_index != -1) {
             char error_msg[BUFFER_SIZE];
             snprintf(error_msg, BUFFER_SIZE, "* Error: User '%s' not found\n", to_username);
-            send_message_to_socket(shared_data->clients[from_index].socket, error_msg);
+            send_message_to_client(from_index, error_msg);
         }
         sem_post(mutex_sem);
         return;
@@ -222,12 +626,12 @@ void send_private_message(const char *from_username, const char *to_username, co
 
     char formatted_msg[BUFFER_SIZE];
     snprintf(formatted_msg, BUFFER_SIZE, "[PM from %s]: %s\n", from_username, message);
-    send_message_to_socket(shared_data->clients[to_index].socket, formatted_msg);
+    send_message_to_client(to_index, formatted_msg);
 
     int from_index = find_client_by_username(from_username);
     if (from_index != -1) {
         snprintf(formatted_msg, BUFFER_SIZE, "[PM to %s]: %s\n", to_username, message);
-        send_message_to_socket(shared_data->clients[from_index].socket, formatted_msg);
+        send_message_to_client(from_index, formatted_msg);
     }
     sem_post(mutex_sem);
 }
@@ -244,16 +648,11 @@ void join_room(int client_index, const char *new_room) {
     snprintf(leave_msg, BUFFER_SIZE, "* %s has left the room\n", 
              shared_data->clients[client_index].username);
     
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (shared_data->clients[i].is_active && 
-            strcmp(shared_data->clients[i].current_room, old_room) == 0 &&
-            i != client_index) {
-            send_message_to_socket(shared_data->clients[i].socket, leave_msg);
-        }
-    }
+    broadcast_to_room_locked(leave_msg, old_room, client_index);
     
     // Update client's room
     strncpy(shared_data->clients[client_index].current_room, new_room, ROOM_NAME_SIZE);
+    shared_data->clients[client_index].in_large_room = find_large_room(new_room) != NULL;
     
     // Send join message to new room
     char join_msg[BUFFER_SIZE];
@@ -263,134 +662,167 @@ void join_room(int client_index, const char *new_room) {
     // Send room change confirmation to the client
     char confirm_msg[BUFFER_SIZE];
     snprintf(confirm_msg, BUFFER_SIZE, "* You have joined room: %s\n", new_room);
-    send_message_to_socket(shared_data->clients[client_index].socket, confirm_msg);
+    send_message_to_client(client_index, confirm_msg);
     
     // Notify others in the new room
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (shared_data->clients[i].is_active && 
-            strcmp(shared_data->clients[i].current_room, new_room) == 0 &&
-            i != client_index) {
-            send_message_to_socket(shared_data->clients[i].socket, join_msg);
-        }
-    }
+    broadcast_to_room_locked(join_msg, new_room, client_index);
     
     sem_post(mutex_sem);
 }
 
-void handle_client_disconnect(int client_index) {
+void remove_client(int client_index) {
     sem_wait(mutex_sem);
     if (shared_data->clients[client_index].is_active) {
         char leave_msg[BUFFER_SIZE];
         snprintf(leave_msg, BUFFER_SIZE, "* %s has left the chat\n", 
                  shared_data->clients[client_index].username);
-        broadcast_to_room(leave_msg, shared_data->clients[client_index].current_room, -1);
+        // Already holding mutex_sem, so use the locked variant
+        broadcast_to_room_locked(leave_msg, shared_data->clients[client_index].current_room, -1);
         
         close(shared_data->clients[client_index].socket);
         shared_data->clients[client_index].is_active = false;
         printf("Client %s disconnected\n", shared_data->clients[client_index].username);
     }
     sem_post(mutex_sem);
+}
+
+void handle_client_disconnect(int client_index) {
+    remove_client(client_index);
     
     // Exit the child process
     exit(0);
 }
 
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    
+int register_client(int client_socket) {
     sem_wait(mutex_sem);
     int client_index = find_free_slot();
     if (client_index == -1) {
         printf("No free slots for new client\n");
         close(client_socket);
         sem_post(mutex_sem);
-        return;
+        return -1;
     }
     
     shared_data->clients[client_index].socket = client_socket;
     shared_data->clients[client_index].is_active = true;
     shared_data->clients[client_index].handler_pid = getpid();
     strncpy(shared_data->clients[client_index].current_room, "general", ROOM_NAME_SIZE);
+    shared_data->clients[client_index].in_large_room = find_large_room("general") != NULL;
     sem_post(mutex_sem);
+    return client_index;
+}
+
+// Returns false if the client was rejected and its slot released
+bool handle_join(int client_index, const char *buffer) {
+    int client_socket = shared_data->clients[client_index].socket;
+    char username[USERNAME_SIZE];
+    if (sscanf(buffer, "JOIN:%31s", username) != 1) {
+        return true;
+    }
+
+    sem_wait(mutex_sem);
+    if (find_client_by_username(username) != -1) {
+        char error_msg[BUFFER_SIZE];
+        snprintf(error_msg, BUFFER_SIZE, "* Error: Username '%s' is already taken\n", username);
+        send_message_to_client(client_index, error_msg);
+        shared_data->clients[client_index].is_active = false;
+        close(client_socket);
+        sem_post(mutex_sem);
+        return false;
+    }
+    
+    strncpy(shared_data->clients[client_index].username, username, USERNAME_SIZE);
+    printf("User %s joined (socket: %d, index: %d)\n", username, client_socket, client_index);
+    sem_post(mutex_sem);
+    
+    char welcome_msg[BUFFER_SIZE];
+    snprintf(welcome_msg, BUFFER_SIZE, 
+        "* Welcome to the chat, %s!\n"
+        "Available commands:\n"
+        "  /join <room>  - Join a chat room\n"
+        "  /pm <user> <message>  - Send a private message to a user\n"
+        "  /exit  - Leave the chat\n"
+        "You are currently in the 'general' room.\n", 
+        username);
+    send_message_to_client(client_index, welcome_msg);
+    
+    char join_msg[BUFFER_SIZE];
+    snprintf(join_msg, BUFFER_SIZE, "* %s has joined the chat\n", username);
+    broadcast_to_room(join_msg, "general", -1);
+    return true;
+}
+
+// Returns false once the client has asked to leave
+bool process_client_message(int client_index, const char *buffer) {
+    printf("Received from %s: %s\n", shared_data->clients[client_index].username, buffer);
+
+    if (strncmp(buffer, "/pm ", 4) == 0) {
+        char to_username[USERNAME_SIZE];
+        char message[BUFFER_SIZE];
+        const char *space_pos = strchr(buffer + 4, ' ');
+        if (space_pos != NULL && space_pos - (buffer + 4) < USERNAME_SIZE) {
+            int username_len = space_pos - (buffer + 4);
+            strncpy(to_username, buffer + 4, username_len);
+            to_username[username_len] = '\0';
+            strncpy(message, space_pos + 1, BUFFER_SIZE - 1);
+            message[BUFFER_SIZE - 1] = '\0';
+            send_private_message(shared_data->clients[client_index].username, to_username, message);
+        }
+    }
+    else if (strncmp(buffer, "/join ", 6) == 0) {
+        char room_name[ROOM_NAME_SIZE];
+        strncpy(room_name, buffer + 6, ROOM_NAME_SIZE - 1);
+        room_name[ROOM_NAME_SIZE - 1] = '\0';
+        join_room(client_index, room_name);
+    }
+    else if (strncmp(buffer, "/exit", 5) == 0) {
+        // Send exit acknowledgment to the client
+        send_message_to_client(client_index, "SERVER_EXIT_ACK\n");
+        return false;
+    }
+    else {
+        char formatted_msg[BUFFER_SIZE];
+        snprintf(formatted_msg, BUFFER_SIZE, "%s: %s\n", 
+                 shared_data->clients[client_index].username, buffer);
+        broadcast_to_room(formatted_msg, shared_data->clients[client_index].current_room, -1);
+    }
+    return true;
+}
+
+void handle_client(int client_socket) {
+    char buffer[BUFFER_SIZE];
+    int bytes_received;
+    
+    int client_index = register_client(client_socket);
+    if (client_index == -1) {
+        return;
+    }
     
     bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
     if (bytes_received > 0) {
         buffer[bytes_received] = '\0';
-        char username[USERNAME_SIZE];
-        if (sscanf(buffer, "JOIN:%s", username) == 1) {
-            sem_wait(mutex_sem);
-            if (find_client_by_username(username) != -1) {
-                char error_msg[BUFFER_SIZE];
-                snprintf(error_msg, BUFFER_SIZE, "* Error: Username '%s' is already taken\n", username);
-                send_message_to_socket(client_socket, error_msg);
-                shared_data->clients[client_index].is_active = false;
-                close(client_socket);
-                sem_post(mutex_sem);
-                return;
-            }
-            
-            strncpy(shared_data->clients[client_index].username, username, USERNAME_SIZE);
-            printf("User %s joined (socket: %d, index: %d)\n", username, client_socket, client_index);
-            sem_post(mutex_sem);
-            
-            char welcome_msg[BUFFER_SIZE];
-            snprintf(welcome_msg, BUFFER_SIZE, 
-                "* Welcome to the chat, %s!\n"
-                "Available commands:\n"
-                "  /join <room>  - Join a chat room\n"
-                "  /pm <user> <message>  - Send a private message to a user\n"
-                "  /exit  - Leave the chat\n"
-                "You are currently in the 'general' room.\n", 
-                username);
-            send_message_to_socket(client_socket, welcome_msg);
-            
-            char join_msg[BUFFER_SIZE];
-            snprintf(join_msg, BUFFER_SIZE, "* %s has joined the chat\n", username);
-            broadcast_to_room(join_msg, "general", -1);
+        if (!handle_join(client_index, buffer)) {
+            return;
         }
     }
 
     while ((bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0)) > 0) {
         buffer[bytes_received] = '\0';
-        printf("Received from %s: %s\n", shared_data->clients[client_index].username, buffer);
-
-        if (strncmp(buffer, "/pm ", 4) == 0) {
-            char to_username[USERNAME_SIZE];
-            char message[BUFFER_SIZE];
-            char *space_pos = strchr(buffer + 4, ' ');
-            if (space_pos != NULL) {
-                int username_len = space_pos - (buffer + 4);
-                strncpy(to_username, buffer + 4, username_len);
-                to_username[username_len] = '\0';
-                strncpy(message, space_pos + 1, BUFFER_SIZE - 1);
-                send_private_message(shared_data->clients[client_index].username, to_username, message);
-            }
-        }
-        else if (strncmp(buffer, "/join ", 6) == 0) {
-            char room_name[ROOM_NAME_SIZE];
-            strncpy(room_name, buffer + 6, ROOM_NAME_SIZE - 1);
-            room_name[ROOM_NAME_SIZE - 1] = '\0';
-            join_room(client_index, room_name);
-        }
-        else if (strncmp(buffer, "/exit", 5) == 0) {
-            // Send exit acknowledgment to the client
-            send_message_to_socket(shared_data->clients[client_index].socket, "SERVER_EXIT_ACK\n");
-            handle_client_disconnect(client_index);
-            return;  // Exit the handle_client function immediately
-        }
-        else {
-            char formatted_msg[BUFFER_SIZE];
-            snprintf(formatted_msg, BUFFER_SIZE, "%s: %s\n", 
-                     shared_data->clients[client_index].username, buffer);
-            broadcast_to_room(formatted_msg, shared_data->clients[client_index].current_room, -1);
+        if (!process_client_message(client_index, buffer)) {
+            break;
         }
     }
 
     handle_client_disconnect(client_index);
 }
 
-int main() {
+#ifndef CHAT_SIM
+void print_usage(char *program) {
+    printf("Usage: %s [--large-room <room>]...\n", program);
+    printf("  --large-room <room>  Coalesce messages in <room> into one batch every %d ms\n", ROOM_TICK_MS);
+}
+
+int main(int argc, char *argv[]) {
     // Store the main process ID
     main_pid = getpid();
     
@@ -407,6 +839,19 @@ int main() {
     // Initialize shared memory and IPC
     init_shared_memory();
     
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--large-room") == 0 && i + 1 < argc) {
+            if (add_large_room(argv[++i]) < 0) {
+                fprintf(stderr, "Too many large rooms (max %d)\n", MAX_LARGE_ROOMS);
+                exit(EXIT_FAILURE);
+            }
+            printf("Large-room mode enabled for room: %s\n", argv[i]);
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
     // Create message handler thread
     if (pthread_create(&msg_thread, NULL, message_handler, NULL) != 0) {
         perror("Failed to create message handler thread");
@@ -414,6 +859,16 @@ int main() {
         exit(EXIT_FAILURE);
     }
     
+    // Create batch flush thread only when some room opted in
+    if (shared_data->large_room_count > 0) {
+        if (pthread_create(&room_thread, NULL, room_flush_handler, NULL) != 0) {
+            perror("Failed to create room flush thread");
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+        room_thread_started = true;
+    }
+    
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
         perror("Failed to create socket");
@@ -498,4 +953,510 @@ int main() {
     close(server_socket);
     cleanup();
     return 0;
-}
\ No newline at end of file
+}
+#else  /* CHAT_SIM */
+
+// Deterministic simulation build: gcc -DCHAT_SIM -o server_sim server.c -pthread
+// All simulated users live in this one process and talk to the server core
+// over in-memory socket pairs. Time is a virtual millisecond counter, and all
+// scheduling, latency, drops and partitions come from one seeded generator,
+// so the same arguments always replay the same run.
+//
+// Client handlers run inline instead of in forked children. The message pipe
+// is a queue drained by a simulated handler that takes its turn among the
+// users in a shuffled order each tick. Sends the real server would block on
+// are kept in a per-user outbound queue that drains as that user reads.
+
+#define SIM_ROOM_COUNT 4
+#define SIM_SLOW_READ_MS 500
+#define SIM_FAST_READ_MS 10
+
+static const char *sim_rooms[SIM_ROOM_COUNT] = {"general", "dev", "random", "ops"};
+
+typedef struct {
+    uint64_t seed;
+    int users;
+    uint64_t duration_ms;
+    int latency_ms;      // Max injected client->server delay
+    int drop_pct;        // Chance a client message is lost
+    int partition_pct;   // Chance per user per virtual second of a partition
+    int slow_pct;        // Share of users that rarely read their socket
+    int send_interval_ms;
+    int handler_batch;   // Pipe messages delivered per tick, 0 for all
+    bool verbose;
+} SimConfig;
+
+typedef struct {
+    int fd;  // Simulated client's end of the socket pair
+    int client_index;
+    bool connected;
+    bool slow;
+    uint64_t next_send_ms;
+    uint64_t next_read_ms;
+    uint64_t partition_until_ms;
+    uint64_t reconnect_ms;
+    bool has_pending;
+    uint64_t pending_due_ms;
+    char pending[BUFFER_SIZE];
+} SimUser;
+
+typedef struct {
+    long sent;
+    long dropped;
+    long partitions;
+    long reconnects;
+    long bytes_received;
+    long stale;             // Pipe messages whose target left before delivery
+    long queued_bytes;      // Bytes the handler blocked on
+    long max_queued_bytes;  // Largest single blocked write
+    long discarded_bytes;   // Blocked bytes lost when their user disconnected
+    long handler_stalls;    // Handler turns spent blocked on one slow reader
+    long producer_stalls;   // User turns spent waiting for room in a full pipe
+    uint64_t checksum;      // FNV-1a over everything the users received
+} SimStats;
+
+// Stands in for the message pipe between client handlers and message_handler.
+// Its capacity is probed from the real socketpair; one command may push past
+// it (a broadcast is a single call), but no user runs another until it drains.
+typedef struct {
+    MessageData *items;
+    size_t head;
+    size_t len;
+    size_t cap;
+} SimPipe;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} SimOutbound;
+
+static SimConfig sim_config = {1, 20, 10000, 20, 1, 1, 10, 200, 0, false};
+static SimStats sim_stats = {.checksum = 1469598103934665603ULL};
+static SimPipe sim_pipe;
+static size_t sim_pipe_capacity;
+static SimOutbound sim_outbound[MAX_CLIENTS];
+static int sim_handler_blocked_on = -1;  // Slot the handler is stuck writing to
+static uint64_t sim_rng_state;
+static uint64_t sim_now_ms;
+
+static uint64_t sim_rand(void) {
+    // xorshift64*
+    sim_rng_state ^= sim_rng_state >> 12;
+    sim_rng_state ^= sim_rng_state << 25;
+    sim_rng_state ^= sim_rng_state >> 27;
+    return sim_rng_state * 2685821657736338717ULL;
+}
+
+static void sim_pipe_push(const MessageData *msg_data) {
+    if (sim_pipe.len == sim_pipe.cap) {
+        if (sim_pipe.head > 0) {
+            sim_pipe.len -= sim_pipe.head;
+            memmove(sim_pipe.items, sim_pipe.items + sim_pipe.head, sim_pipe.len * sizeof(MessageData));
+            sim_pipe.head = 0;
+        } else {
+            size_t cap = sim_pipe.cap ? sim_pipe.cap * 2 : 1024;
+            MessageData *items = realloc(sim_pipe.items, cap * sizeof(MessageData));
+            if (items == NULL) {
+                perror("realloc failed");
+                exit(EXIT_FAILURE);
+            }
+            sim_pipe.items = items;
+            sim_pipe.cap = cap;
+        }
+    }
+    sim_pipe.items[sim_pipe.len++] = *msg_data;
+}
+
+static size_t sim_probe_pipe_capacity(void) {
+    MessageData probe;
+    memset(&probe, 0, sizeof(probe));
+    size_t capacity = 0;
+    while (send(shared_data->message_pipe[1], &probe, sizeof(probe), MSG_DONTWAIT) == sizeof(probe)) {
+        capacity++;
+    }
+    while (recv(shared_data->message_pipe[0], &probe, sizeof(probe), MSG_DONTWAIT) > 0) {
+    }
+    return capacity;
+}
+
+static bool sim_pipe_full(void) {
+    return sim_pipe.len - sim_pipe.head >= sim_pipe_capacity;
+}
+
+static bool sim_outbound_pending(int client_index) {
+    return sim_outbound[client_index].len > 0;
+}
+
+// Like the real message_handler thread, a write to a full socket stops all
+// delivery until that one reader makes room
+static void sim_run_message_handler(void) {
+    if (sim_handler_blocked_on != -1) {
+        if (sim_outbound_pending(sim_handler_blocked_on)) {
+            sim_stats.handler_stalls++;
+            return;
+        }
+        sim_handler_blocked_on = -1;
+    }
+
+    size_t limit = sim_config.handler_batch > 0 ? (size_t)sim_config.handler_batch : SIZE_MAX;
+    while (sim_pipe.head < sim_pipe.len && sim_handler_blocked_on == -1 && limit-- > 0) {
+        const MessageData *msg_data = &sim_pipe.items[sim_pipe.head++];
+        Client *client = &shared_data->clients[msg_data->target_index];
+        if (!client->is_active || client->socket != msg_data->target_socket) {
+            sim_stats.stale++;
+            continue;
+        }
+        deliver_message(msg_data);
+    }
+    if (sim_pipe.head == sim_pipe.len) {
+        sim_pipe.head = 0;
+        sim_pipe.len = 0;
+    }
+}
+
+static void sim_send_blocking(int client_index, int socket, const char *data, size_t len) {
+    SimOutbound *queue = &sim_outbound[client_index];
+    size_t sent = 0;
+    if (queue->len == 0) {
+        ssize_t n = send(socket, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            sent = n;
+        }
+    }
+    if (sent == len) {
+        return;
+    }
+
+    size_t remaining = len - sent;
+    if (queue->len + remaining > queue->cap) {
+        size_t cap = queue->cap ? queue->cap : BUFFER_SIZE;
+        while (cap < queue->len + remaining) {
+            cap *= 2;
+        }
+        char *grown = realloc(queue->data, cap);
+        if (grown == NULL) {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        queue->data = grown;
+        queue->cap = cap;
+    }
+    memcpy(queue->data + queue->len, data + sent, remaining);
+    queue->len += remaining;
+    sim_handler_blocked_on = client_index;
+    sim_stats.queued_bytes += remaining;
+    if ((long)queue->len > sim_stats.max_queued_bytes) {
+        sim_stats.max_queued_bytes = queue->len;
+    }
+}
+
+// Returns true if any queued bytes went out
+static bool sim_flush_outbound(SimUser *user) {
+    SimOutbound *queue = &sim_outbound[user->client_index];
+    int socket = shared_data->clients[user->client_index].socket;
+    bool progress = false;
+    while (queue->len > 0) {
+        ssize_t n = send(socket, queue->data, queue->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n <= 0) {
+            break;
+        }
+        queue->len -= n;
+        memmove(queue->data, queue->data + n, queue->len);
+        progress = true;
+    }
+    return progress;
+}
+
+static void sim_connect(SimUser *user, int id) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        perror("socketpair failed");
+        exit(EXIT_FAILURE);
+    }
+    // A server-side send must never stall the only thread
+    fcntl(pair[0], F_SETFL, O_NONBLOCK);
+
+    int client_index = register_client(pair[0]);
+    if (client_index == -1) {
+        close(pair[1]);
+        return;
+    }
+
+    char join_msg[BUFFER_SIZE];
+    snprintf(join_msg, BUFFER_SIZE, "JOIN:user%d", id);
+    if (!handle_join(client_index, join_msg)) {
+        close(pair[1]);
+        return;
+    }
+
+    user->fd = pair[1];
+    user->client_index = client_index;
+    user->connected = true;
+    user->has_pending = false;
+    user->next_send_ms = sim_now_ms + 1 + sim_rand() % sim_config.send_interval_ms;
+    user->next_read_ms = sim_now_ms;
+}
+
+static void sim_read(SimUser *user) {
+    char buffer[BUFFER_SIZE];
+    ssize_t n;
+    do {
+        while ((n = recv(user->fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            sim_stats.bytes_received += n;
+            for (ssize_t i = 0; i < n; i++) {
+                sim_stats.checksum ^= (unsigned char)buffer[i];
+                sim_stats.checksum *= 1099511628211ULL;
+            }
+        }
+    } while (sim_flush_outbound(user));
+}
+
+static void sim_disconnect(SimUser *user) {
+    remove_client(user->client_index);
+
+    // The fd number will be reused by the next socket pair
+    SubscriberLag *lag = &lag_state[user->client_index];
+    lag->socket = -1;
+    lag->skipped = 0;
+    lag->tail_len = 0;
+
+    sim_read(user);
+    sim_stats.discarded_bytes += sim_outbound[user->client_index].len;
+    sim_outbound[user->client_index].len = 0;
+    close(user->fd);
+    user->connected = false;
+    user->reconnect_ms = sim_now_ms + 1000 + sim_rand() % 1000;
+}
+
+static void sim_schedule_send(SimUser *user, int id, bool partitioned) {
+    uint64_t roll = sim_rand() % 1000;
+    if (roll < 5) {
+        snprintf(user->pending, BUFFER_SIZE, "/exit");
+    } else if (roll < 60) {
+        snprintf(user->pending, BUFFER_SIZE, "/join %s", sim_rooms[sim_rand() % SIM_ROOM_COUNT]);
+    } else if (roll < 100) {
+        snprintf(user->pending, BUFFER_SIZE, "/pm user%d hello from user%d",
+                 (int)(sim_rand() % sim_config.users), id);
+    } else {
+        snprintf(user->pending, BUFFER_SIZE, "message %ld from user%d", sim_stats.sent, id);
+    }
+
+    sim_stats.sent++;
+    user->next_send_ms = sim_now_ms + 1 + sim_rand() % sim_config.send_interval_ms;
+    if (partitioned || (int)(sim_rand() % 100) < sim_config.drop_pct) {
+        sim_stats.dropped++;
+        return;
+    }
+    user->has_pending = true;
+    user->pending_due_ms = sim_now_ms + sim_rand() % (sim_config.latency_ms + 1);
+}
+
+static void sim_step_user(SimUser *user, int id) {
+    if (!user->connected) {
+        if (user->reconnect_ms != 0 && sim_now_ms >= user->reconnect_ms && !sim_pipe_full()) {
+            sim_stats.reconnects++;
+            user->reconnect_ms = 0;
+            sim_connect(user, id);
+        }
+        return;
+    }
+
+    bool partitioned = sim_now_ms < user->partition_until_ms;
+    if (!partitioned && (int)(sim_rand() % 100000) < sim_config.partition_pct) {
+        sim_stats.partitions++;
+        user->partition_until_ms = sim_now_ms + 200 + sim_rand() % 2000;
+        partitioned = true;
+    }
+
+    if (!user->has_pending && sim_now_ms >= user->next_send_ms) {
+        sim_schedule_send(user, id, partitioned);
+    }
+
+    if (user->has_pending && sim_now_ms >= user->pending_due_ms) {
+        if (sim_pipe_full()) {
+            // A real client handler would block in write(), holding mutex_sem
+            sim_stats.producer_stalls++;
+        } else {
+            user->has_pending = false;
+            if (!process_client_message(user->client_index, user->pending)) {
+                sim_disconnect(user);
+                return;
+            }
+        }
+    }
+
+    if (!partitioned && sim_now_ms >= user->next_read_ms) {
+        sim_read(user);
+        user->next_read_ms = sim_now_ms + (user->slow ? SIM_SLOW_READ_MS : SIM_FAST_READ_MS);
+    }
+}
+
+void print_usage(char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --seed <n>            Seed for all scheduling decisions (default %llu)\n",
+           (unsigned long long)sim_config.seed);
+    printf("  --users <n>           Simulated users, at most %d (default %d)\n", MAX_CLIENTS, sim_config.users);
+    printf("  --duration-ms <n>     Virtual run length (default %llu)\n",
+           (unsigned long long)sim_config.duration_ms);
+    printf("  --latency-ms <n>      Max client->server delay (default %d)\n", sim_config.latency_ms);
+    printf("  --drop-pct <n>        Percent of client messages lost (default %d)\n", sim_config.drop_pct);
+    printf("  --partition-pct <n>   Percent chance per user per second of a partition (default %d)\n",
+           sim_config.partition_pct);
+    printf("  --slow-pct <n>        Percent of users that read every %d ms (default %d)\n",
+           SIM_SLOW_READ_MS, sim_config.slow_pct);
+    printf("  --send-interval-ms <n> Max gap between a user's messages (default %d)\n",
+           sim_config.send_interval_ms);
+    printf("  --handler-batch <n>   Pipe messages delivered per tick, 0 for all (default %d)\n",
+           sim_config.handler_batch);
+    printf("  --large-room <room>   Enable large-room mode for <room>\n");
+    printf("  --verbose             Keep the server's own logging on stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    main_pid = getpid();
+    init_shared_memory();
+    // Private to this run, so concurrent simulations don't share them
+    sem_unlink(SEM_NAME);
+    sem_unlink(FLUSH_SEM_NAME);
+    sim_pipe_capacity = sim_probe_pipe_capacity();
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--verbose") == 0) {
+            sim_config.verbose = true;
+            continue;
+        }
+        if (value == NULL) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        i++;
+        if (strcmp(arg, "--seed") == 0) {
+            sim_config.seed = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--users") == 0) {
+            sim_config.users = atoi(value);
+        } else if (strcmp(arg, "--duration-ms") == 0) {
+            sim_config.duration_ms = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--latency-ms") == 0) {
+            sim_config.latency_ms = atoi(value);
+        } else if (strcmp(arg, "--drop-pct") == 0) {
+            sim_config.drop_pct = atoi(value);
+        } else if (strcmp(arg, "--partition-pct") == 0) {
+            sim_config.partition_pct = atoi(value);
+        } else if (strcmp(arg, "--slow-pct") == 0) {
+            sim_config.slow_pct = atoi(value);
+        } else if (strcmp(arg, "--send-interval-ms") == 0) {
+            sim_config.send_interval_ms = atoi(value);
+        } else if (strcmp(arg, "--handler-batch") == 0) {
+            sim_config.handler_batch = atoi(value);
+        } else if (strcmp(arg, "--large-room") == 0) {
+            if (add_large_room(value) < 0) {
+                fprintf(stderr, "Too many large rooms (max %d)\n", MAX_LARGE_ROOMS);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (sim_config.users < 1 || sim_config.users > MAX_CLIENTS ||
+        sim_config.latency_ms < 0 || sim_config.send_interval_ms < 1) {
+        fprintf(stderr, "Invalid simulation parameters (users must be 1..%d, rebuild with "
+                "-DMAX_CLIENTS=<n> for more)\n", MAX_CLIENTS);
+        exit(EXIT_FAILURE);
+    }
+
+    // Two fds per simulated user
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (!sim_config.verbose && freopen("/dev/null", "w", stdout) == NULL) {
+        perror("freopen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    sim_rng_state = sim_config.seed != 0 ? sim_config.seed : 1;
+    // One extra actor for the message handler
+    int actor_count = sim_config.users + 1;
+    SimUser *users = calloc(sim_config.users, sizeof(SimUser));
+    int *order = malloc(actor_count * sizeof(int));
+    if (users == NULL || order == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    for (int i = 0; i < sim_config.users; i++) {
+        users[i].slow = (int)(sim_rand() % 100) < sim_config.slow_pct;
+        sim_connect(&users[i], i);
+    }
+
+    for (sim_now_ms = 0; sim_now_ms < sim_config.duration_ms; sim_now_ms++) {
+        for (int i = 0; i < actor_count; i++) {
+            order[i] = i;
+        }
+        for (int i = actor_count - 1; i > 0; i--) {
+            int j = sim_rand() % (i + 1);
+            int swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+        for (int i = 0; i < actor_count; i++) {
+            if (order[i] == sim_config.users) {
+                sim_run_message_handler();
+            } else {
+                sim_step_user(&users[order[i]], order[i]);
+            }
+        }
+        if (sim_now_ms % ROOM_TICK_MS == 0) {
+            for (int i = 0; i < shared_data->large_room_count; i++) {
+                flush_large_room(i);
+            }
+            retry_lagging_clients();
+        }
+    }
+
+    for (int i = 0; i < sim_config.users; i++) {
+        if (users[i].connected) {
+            sim_read(&users[i]);
+            close(users[i].fd);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall_ms = (wall_end.tv_sec - wall_start.tv_sec) * 1000.0 +
+                     (wall_end.tv_nsec - wall_start.tv_nsec) / 1000000.0;
+
+    fprintf(stderr, "Simulation seed %llu: %d users, %llu virtual ms in %.1f wall ms\n",
+            (unsigned long long)sim_config.seed, sim_config.users,
+            (unsigned long long)sim_config.duration_ms, wall_ms);
+    fprintf(stderr, "  sent %ld, dropped %ld, partitions %ld, reconnects %ld\n",
+            sim_stats.sent, sim_stats.dropped, sim_stats.partitions, sim_stats.reconnects);
+    fprintf(stderr, "  pipe: capacity %zu, %ld stale (target left before delivery), %zu still queued, "
+            "%ld user turns stalled on a full pipe\n",
+            sim_pipe_capacity, sim_stats.stale, sim_pipe.len - sim_pipe.head, sim_stats.producer_stalls);
+    fprintf(stderr, "  handler: %ld turns blocked on a slow reader, %ld bytes blocked on (peak %ld), "
+            "%ld discarded on disconnect\n",
+            sim_stats.handler_stalls, sim_stats.queued_bytes, sim_stats.max_queued_bytes,
+            sim_stats.discarded_bytes);
+    fprintf(stderr, "  received %ld bytes, checksum %016llx\n",
+            sim_stats.bytes_received, (unsigned long long)sim_stats.checksum);
+
+    free(order);
+    free(users);
+    sem_close(mutex_sem);
+    sem_close(flush_sem);
+    close(shared_data->message_pipe[0]);
+    close(shared_data->message_pipe[1]);
+    munmap(shared_data, sizeof(SharedData));
+    return 0;
+}
+#endif  /* CHAT_SIM */